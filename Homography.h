@@ -9,35 +9,49 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <memory>
 
 /*Project Utils*/
+#include "tiled_canvas.h"
 #include "functions.h"
+#include "frame_context.h"
 
 
 
-//////////////////////////////////////////// TYPE MAPPINGS (ABSTRACT DATA TYPES) ////////////////////////////////////////////
-
-typedef std::vector <std::pair <cv::Point2f, cv::Point2f>> Mapper;
-
-////////////////////////////////
-
-
 //////////////////////////////////////////// Homography Interface ////////////////////////////////////////////
 
 
 /*
 * Homography class interface. Every Homography implementation must extend from this class.
 * 
+* Implementations either copy the mapping points and use their own buffers, or are given a FrameContext: then the
+* points are only referenced (they must outlive the object) and all the work buffers come from the context.
 */
 class Homography {
 public:
 	virtual cv::Mat calculate() = 0;
 	virtual cv::Mat calculate(const Mapper& mappingPoints) = 0;
-    cv::Mat& projectAndSave(const cv::Mat&, const cv::Mat&, int);
-
-    cv::Mat getHomography() {return this->m_homography;}
+    void project(const cv::Mat&, const cv::Mat&, cv::Mat&);
+    static void project(const cv::Mat&, const cv::Mat&, const cv::Mat& homography, cv::Mat&);
+    const cv::Mat& projectAndSave(const cv::Mat&, const cv::Mat&, int);
+    const cv::Mat& projectAndSave(const cv::Mat&, const cv::Mat&, const std::string& outputName);
+    void projectAndSaveTiled(const cv::Mat&, const cv::Mat&, int, int tileSize = 512,
+                             unsigned int threadsCount = std::thread::hardware_concurrency());
+
+    cv::Mat getHomography() {return this->m_homography.clone();}   // a copy, the next calculate() reuses the storage.
 protected:
-	Mapper m_mappingPoints;
+    const Mapper& points() const { return this->m_externalPoints ? *this->m_externalPoints : this->m_mappingPoints; }
+    FrameContext& context();
+    cv::Matx33f solveDLT(const Mapper::value_type* pointPairs, int ptsNum, const cv::Matx33f& T, const cv::Matx33f& T_);
+    cv::Matx33f solveDLT(const Mapper& pointPairs, const cv::Matx33f& T, const cv::Matx33f& T_) {
+        return this->solveDLT(pointPairs.data(), (int)pointPairs.size(), T, T_);
+    }
+    void storeHomography(const cv::Matx33f& H);
+
+	Mapper m_mappingPoints;                     // own copy of the points (no FrameContext given).
+    const Mapper* m_externalPoints = NULL;      // the points referenced when a FrameContext is given.
+    FrameContext* m_context = NULL;
+    std::unique_ptr<FrameContext> m_ownContext; // created on first use when no FrameContext is given.
 	std::string m_windowName;
 	bool m_showWindow;		
 	cv::Mat m_homography;	// stores the last homography that were calculated.
@@ -50,19 +64,170 @@ protected:
 //////////////////////////////////////////// Homography Function Definitions ////////////////////////////////////////////
 
 
-cv::Mat& Homography::projectAndSave(const cv::Mat& firstImage, const cv::Mat& secondImage, int imageIndex = 0) {
-    cv::Mat transformedImage = cv::Mat::zeros(1.5 * firstImage.size().height,
+/// <summary>
+///     The given frame context, or one of its own, which is only created when the object needs buffers without
+///     having been given a context.
+/// </summary>
+FrameContext& Homography::context() {
+    if (this->m_context) return *this->m_context;
+    if (!this->m_ownContext) this->m_ownContext.reset(new FrameContext());
+    return *this->m_ownContext;
+}
+
+
+/// <summary>
+///     Output name of projectAndSave for the given image index: "HOMOGRAPHY_n.png".
+/// </summary>
+std::string homographyOutputName(int imageIndex) {
+    return "HOMOGRAPHY_" + std::to_string(imageIndex) + ".png";
+}
+
+
+/// <summary>
+///     Direct linear transformation. Fills "A" from the point pairs (the first points normalized by T, the second
+///     by T_, pass identities for no normalization) and returns the homography of the normalized points: the eigen
+///     vector of AT A with the smallest eigen value. The matrices are scratch of the frame context's arena, so
+///     repeated calls don't allocate them.
+/// </summary>
+cv::Matx33f Homography::solveDLT(const Mapper::value_type* pointPairs, int ptsNum, const cv::Matx33f& T, const cv::Matx33f& T_) {
+    FrameArena& arena = this->context().arena;
+    FrameArena::Scope scratch(arena);
+    cv::Mat A = arena.mat(2 * ptsNum, 9, CV_32F);
+    cv::Mat ATA = arena.mat(9, 9, CV_32F);
+    cv::Mat eVals = arena.mat(9, 1, CV_32F);
+    cv::Mat eVecs = arena.mat(9, 9, CV_32F);
+
+    // Filling up the Matrix A
+    for (int i = 0; i < ptsNum; i++) {
+        cv::Point2f p1 = transformPoint(pointPairs[i].first, T);
+        float u1 = p1.x;
+        float v1 = p1.y;
+
+        cv::Point2f p2 = transformPoint(pointPairs[i].second, T_);
+        float u2 = p2.x;
+        float v2 = p2.y;
+
+        float* row = A.ptr<float>(2 * i);
+        row[0] = u1;
+        row[1] = v1;
+        row[2] = 1.0f;
+        row[3] = 0.0f;
+        row[4] = 0.0f;
+        row[5] = 0.0f;
+        row[6] = -u2 * u1;
+        row[7] = -u2 * v1;
+        row[8] = -u2;
+
+        row = A.ptr<float>(2 * i + 1);
+        row[0] = 0.0f;
+        row[1] = 0.0f;
+        row[2] = 0.0f;
+        row[3] = u1;
+        row[4] = v1;
+        row[5] = 1.0f;
+        row[6] = -v2 * u1;
+        row[7] = -v2 * v1;
+        row[8] = -v2;
+    }
+
+    // Getting the Eigen vector and values of matrix AT A
+    {
+        ExternalCall opencv;
+        cv::mulTransposed(A, ATA, true);
+        cv::eigen(ATA, eVals, eVecs);
+    }
+
+    // Calculating the homogrophy matrix
+    cv::Matx33f H;
+    for (int i = 0; i < 9; i++)
+        H(i / 3, i % 3) = eVecs.at<float>(8, i);
+
+    //Normalize:
+    H = H * (1.0f / H(2, 2));
+
+#ifdef INFO_LOG
+    std::cout << A << std::endl;
+    std::cout << eVals << std::endl;
+    std::cout << eVecs << std::endl;
+    std::cout << H << std::endl;
+#endif
+    return H;
+}
+
+
+/// <summary>
+///     Copies H into m_homography, reusing its storage.
+/// </summary>
+void Homography::storeHomography(const cv::Matx33f& H) {
+    cv::Mat(H, false).copyTo(this->m_homography);
+}
+
+
+/// <summary>
+///     Stitches the 2 images into output: the second image stays in place and the first one is projected with the
+///     given homography. If output already has the right size and type (e.g. a header over a shared memory
+///     buffer) it is drawn in place, otherwise it is (re)allocated.
+/// </summary>
+void Homography::project(const cv::Mat& firstImage, const cv::Mat& secondImage, const cv::Mat& homography, cv::Mat& output) {
+    output.create(1.5 * firstImage.size().height,
         2.0 * firstImage.size().width,
         firstImage.type());
+    output.setTo(cv::Scalar::all(0));
 
-    transformImage(secondImage, transformedImage, cv::Mat::eye(3, 3, CV_32F), true);
-    transformImage(firstImage, transformedImage, this->m_homography, true);
+    transformImage(secondImage, output, cv::Matx33f::eye(), true);
+    transformImage(firstImage, output, homography, true);
+}
 
+
+/// <summary>
+///     Same as above, with the last calculated homography.
+/// </summary>
+void Homography::project(const cv::Mat& firstImage, const cv::Mat& secondImage, cv::Mat& output) {
+    Homography::project(firstImage, secondImage, this->m_homography, output);
+}
+
+
+/// <summary>
+///     Projects into the canvas of the frame context (reused between frames) and saves it as "HOMOGRAPHY_n.png".
+///     The returned canvas stays valid until the context is used for the next frame.
+/// </summary>
+const cv::Mat& Homography::projectAndSave(const cv::Mat& firstImage, const cv::Mat& secondImage, int imageIndex = 0) {
+    return this->projectAndSave(firstImage, secondImage, homographyOutputName(imageIndex));
+}
+
+
+/// <summary>
+///     Same as above, saved under the given name (a sequence builds its names once, see SEQUENCE_RUN in main.cpp).
+/// </summary>
+const cv::Mat& Homography::projectAndSave(const cv::Mat& firstImage, const cv::Mat& secondImage, const std::string& outputName) {
+    cv::Mat& transformedImage = this->context().canvas;
+    this->project(firstImage, secondImage, transformedImage);
+
+    ExternalCall opencv;
     if (this->m_showWindow) {
         cv::imshow(this->m_windowName, transformedImage);
         cv::waitKey();
     }
-    std::string outputImageName = "HOMOGRAPHY_" + std::to_string(imageIndex) + ".png";
-    cv::imwrite(outputImageName, transformedImage);
+    cv::imwrite(outputName, transformedImage);
     return transformedImage;
-}
\ No newline at end of file
+}
+
+
+
+/// <summary>
+///     Same projection as projectAndSave, but the output is rendered tile by tile into an out-of-core
+///     TiledCanvas ("HOMOGRAPHY_n.tiles" + ".hdr") instead of one in-memory image. Use it when the stitched
+///     output is too large to be held in memory at once.
+/// </summary>
+void Homography::projectAndSaveTiled(const cv::Mat& firstImage, const cv::Mat& secondImage, int imageIndex,
+                                     int tileSize, unsigned int threadsCount) {
+    std::string outputName = "HOMOGRAPHY_" + std::to_string(imageIndex) + ".tiles";
+    TiledCanvas canvas(outputName,
+        2.0 * firstImage.size().width,
+        1.5 * firstImage.size().height,
+        firstImage.type(), tileSize);
+
+    canvas.addSource(secondImage, cv::Mat::eye(3, 3, CV_32F));
+    canvas.addSource(firstImage, this->m_homography);
+    canvas.render(threadsCount);
+}
@@ -0,0 +1,112 @@
+#pragma once
+/*Test build instrumentation, only included with COUNT_ALLOCATIONS (see main.cpp). It replaces the global
+  operator new/delete of the program, so it must not be included by a regular build.*/
+
+/*Open CV stuff*/
+#include <opencv2/core.hpp>
+
+/*Standard Library*/
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/*Project Utils*/
+#include "functions.h"
+
+
+
+static std::atomic<size_t> heapAllocationsCount(0);    // calls of the global operator new (and new[])
+static std::atomic<size_t> matAllocationsCount(0);     // cv::Mat buffers allocated through the default allocator
+static thread_local bool countingThread = false;       // the thread of a live AllocationCounter
+
+
+/*Only the project's own code on the counting thread: not OpenCV's internals (see ExternalCall), and not its
+  worker threads either.*/
+static inline bool countedAllocation() { return countingThread && externalCallDepth == 0; }
+
+
+void* operator new(size_t size) {
+    if (countedAllocation()) heapAllocationsCount++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+
+
+/// <summary>
+///     cv::Mat buffers don't go through operator new (OpenCV uses its own fastMalloc), so they are counted by
+///     wrapping the default MatAllocator. The wrapped allocator stays the owner of every buffer it hands out, so
+///     buffers allocated while counting can be released after the counting stopped.
+/// </summary>
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+    explicit CountingMatAllocator(cv::MatAllocator* wrapped) : m_wrapped(wrapped) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+        if (data == NULL && countedAllocation()) matAllocationsCount++;    // a header over existing data is not an allocation.
+        return this->m_wrapped->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+
+    bool allocate(cv::UMatData* data, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override {
+        return this->m_wrapped->allocate(data, flags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* data) const override { this->m_wrapped->deallocate(data); }
+private:
+    cv::MatAllocator* m_wrapped;
+};
+
+
+
+/// <summary>
+///     Counts the real allocations the project's hot path makes between beginFrame() and endFrame(), on the thread
+///     that created the counter: every call of the global operator new (std::vector/std::string growth, arena
+///     chunks, UMatData headers...) and every cv::Mat buffer. What happens inside OpenCV's calls (ORB, the matcher,
+///     eigen, imwrite) is left out, it is marked with ExternalCall. The Mat counter is installed while the object
+///     lives. Only one counter at a time.
+/// </summary>
+class AllocationCounter {
+public:
+    AllocationCounter() : m_matAllocator(cv::Mat::getDefaultAllocator()),
+        m_frameHeap(0), m_frameMats(0), m_totalHeap(0), m_totalMats(0) {
+        this->m_previousAllocator = cv::Mat::getDefaultAllocator();
+        cv::Mat::setDefaultAllocator(&this->m_matAllocator);
+        countingThread = true;
+        this->beginFrame();
+    }
+
+    ~AllocationCounter() {
+        countingThread = false;
+        cv::Mat::setDefaultAllocator(this->m_previousAllocator);
+    }
+
+    void beginFrame() {
+        this->m_heapStart = heapAllocationsCount;
+        this->m_matStart = matAllocationsCount;
+    }
+
+    void endFrame() {
+        this->m_frameHeap = heapAllocationsCount - this->m_heapStart;
+        this->m_frameMats = matAllocationsCount - this->m_matStart;
+        this->m_totalHeap += this->m_frameHeap;
+        this->m_totalMats += this->m_frameMats;
+    }
+
+    size_t frameAllocations() const { return this->m_frameHeap + this->m_frameMats; }
+    size_t frameHeapAllocations() const { return this->m_frameHeap; }
+    size_t frameMatAllocations() const { return this->m_frameMats; }
+    size_t totalHeapAllocations() const { return this->m_totalHeap; }
+    size_t totalMatAllocations() const { return this->m_totalMats; }
+private:
+    AllocationCounter(const AllocationCounter&);                // non-copyable, it owns the installed allocator.
+    AllocationCounter& operator=(const AllocationCounter&);
+
+    CountingMatAllocator m_matAllocator;
+    cv::MatAllocator* m_previousAllocator;
+    size_t m_heapStart, m_matStart;
+    size_t m_frameHeap, m_frameMats, m_totalHeap, m_totalMats;
+};
@@ -0,0 +1,143 @@
+#pragma once
+/*Open CV stuff*/
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+/*Standard Library*/
+#include <vector>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <type_traits>
+
+/*Project Utils*/
+#include "functions.h"
+
+
+
+#define FRAME_ARENA_ALIGNMENT 16      // every FrameArena allocation starts on this boundary (SSE loads of Mat rows)
+
+
+
+/// <summary>
+///     Scratch memory of one frame: a bump allocator over a single block. The small, short lived buffers of an
+///     estimation (the DLT matrices, the RANSAC samples and inlier indices) are taken from it inside a Scope and all
+///     given back when the scope ends, instead of being allocated one by one.
+///     When a frame needs more than the block holds, the rest comes from overflow chunks; once the outermost scope
+///     ends, the block is regrown to the peak usage and the chunks are freed. From then on the same work fits in
+///     the block and doesn't allocate anymore.
+/// </summary>
+class FrameArena {
+public:
+    /// <summary>
+    ///     Gives back everything allocated from the arena since the scope was opened. Scopes nest.
+    /// </summary>
+    class Scope {
+    public:
+        explicit Scope(FrameArena& arena) : m_arena(arena), m_mark(arena.m_used) {}
+        ~Scope() { this->m_arena.rewind(this->m_mark); }
+    private:
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+
+        FrameArena& m_arena;
+        size_t m_mark;
+    };
+
+
+    FrameArena() : m_used(0), m_peak(0) {}
+
+    /// <summary>
+    ///     count value-initialized elements, valid until the enclosing Scope ends (never destroyed, so only
+    ///     trivially destructible types).
+    /// </summary>
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena memory is released without destructors");
+        static_assert(alignof(T) <= FRAME_ARENA_ALIGNMENT, "arena memory is only aligned to FRAME_ARENA_ALIGNMENT");
+        T* p = (T*)this->bytes(count * sizeof(T));
+        for (size_t i = 0; i < count; i++) new (p + i) T();
+        return p;
+    }
+
+    /// <summary>
+    ///     A (rows x cols) matrix over arena memory. The header doesn't own its data: it must not be used after the
+    ///     enclosing Scope ends, and OpenCV reallocates it (on the heap) if it is passed as an output of another size.
+    /// </summary>
+    cv::Mat mat(int rows, int cols, int type) {
+        return cv::Mat(rows, cols, type, this->bytes((size_t)rows * cols * CV_ELEM_SIZE(type)));
+    }
+
+    size_t capacity() const { return this->m_block.size(); }
+private:
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+
+    unsigned char* bytes(size_t size) {
+        size = (size + FRAME_ARENA_ALIGNMENT - 1) / FRAME_ARENA_ALIGNMENT * FRAME_ARENA_ALIGNMENT;
+        unsigned char* p;
+        if (this->m_used + size <= this->m_block.size())
+            p = this->m_block.data() + this->m_used;
+        else {
+            /*operator new[] is aligned for any fundamental type, the block's storage too.*/
+            this->m_overflow.emplace_back(new unsigned char[size]);
+            p = this->m_overflow.back().get();
+        }
+        this->m_used += size;
+        this->m_peak = std::max(this->m_peak, this->m_used);
+        return p;
+    }
+
+    void rewind(size_t mark) {
+        this->m_used = mark;
+        if (mark == 0 && !this->m_overflow.empty()) {
+            this->m_overflow.clear();
+            this->m_block.resize(this->m_peak);
+        }
+    }
+
+    std::vector<unsigned char> m_block;
+    std::vector<std::unique_ptr<unsigned char[]>> m_overflow;
+    size_t m_used, m_peak;
+};
+
+
+
+/// <summary>
+///     Buffers of the whole pipeline, owned in one place and reused from one frame to the next: the ORB object, the
+///     matcher and the feature matches, the scratch arena of the estimation, the inliers and the output canvas.
+///     Keypoints, descriptors and matches stay std::vector/cv::Mat members of the ImageFeatureMatch, since OpenCV
+///     fills them through its own output types; they are only reallocated when a frame needs more than before.
+///     Once everything has grown to the size a sequence needs, processing a frame doesn't allocate in the
+///     project's code anymore; SEQUENCE_RUN with COUNT_ALLOCATIONS (main.cpp) checks that.
+///     A context must not be shared between threads.
+/// </summary>
+struct FrameContext {
+    /*Feature stage*/
+    cv::Ptr<cv::ORB> orb;
+    cv::Ptr<cv::DescriptorMatcher> bfMatcher;
+    ImageFeatureMatch features;
+
+    /*Homography stage*/
+    FrameArena arena;
+    Mapper bestInliers;
+
+    /*Projection*/
+    cv::Mat canvas;
+
+
+    FrameContext() {}
+
+    cv::Ptr<cv::ORB>& detector() {
+        if (this->orb.empty()) this->orb = cv::ORB::create();
+        return this->orb;
+    }
+
+    cv::Ptr<cv::DescriptorMatcher>& matcher() {
+        if (this->bfMatcher.empty()) this->bfMatcher = cv::BFMatcher::create(cv::NORM_HAMMING, true);
+        return this->bfMatcher;
+    }
+private:
+    FrameContext(const FrameContext&);              // non-copyable, estimators keep references into it.
+    FrameContext& operator=(const FrameContext&);
+};
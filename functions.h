@@ -2,12 +2,14 @@
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
 #include <iostream>
 #include <stdio.h>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <cmath>
+#include <cfloat>
 
 
 using namespace cv;
@@ -15,6 +17,100 @@ using namespace std;
 
 
 
+//////////////////////////////////////////// TYPE MAPPINGS (ABSTRACT DATA TYPES) ////////////////////////////////////////////
+
+typedef std::vector <std::pair <cv::Point2f, cv::Point2f>> Mapper;
+
+////////////////////////////////
+
+
+
+/// <summary>
+///     Marks a call into OpenCV (detection, matching, eigen, imwrite...) for the current thread while the object
+///     lives. What OpenCV allocates internally is none of the project's business: AllocationCounter
+///     (COUNT_ALLOCATIONS in main.cpp) only counts the allocations made outside of these calls.
+/// </summary>
+static thread_local int externalCallDepth = 0;
+
+struct ExternalCall {
+    ExternalCall() { externalCallDepth++; }
+    ~ExternalCall() { externalCallDepth--; }
+private:
+    ExternalCall(const ExternalCall&);
+    ExternalCall& operator=(const ExternalCall&);
+};
+
+
+
+/// <summary>
+///     Scratch buffers of gridBucketKeypoints. Keeping them around (see ImageFeatureMatch) avoids allocating
+///     them again for every image.
+/// </summary>
+struct KeypointBuckets {
+    std::vector<int> cellCounts;
+    std::vector<cv::KeyPoint> selected, remaining;
+};
+
+
+#define BUCKETING_OVERDETECTION 5     // ORB detects this many times the bucketed count, see ImageFeatureMatch::match
+#define ORB_DEFAULT_FEATURES 500      // ORB::create() default
+#define ROI_MIN_FEATURES 100          // lower bound of the ORB budget when it is scaled down to a region of interest
+
+
+/// <summary>
+///     Spatially balanced keypoint selection (grid bucketing). ORB corners tend to cluster in the textured areas,
+///     so keeping the N strongest ones leaves large parts of the overlap without any feature. Here the image is
+///     split into a gridCols x gridRows grid and every cell gets an equal quota of its strongest keypoints. Cells
+///     that don't use up their quota (textureless regions) hand it over: the quota is raised step by step for the
+///     remaining keypoints until maxKeypoints are selected. Meant to run before computing the descriptors, on a
+///     detection several times larger than maxKeypoints, so that the weaker corners of the sparse cells are
+///     among the candidates.
+/// </summary>
+/// <param name="keypoints">Detected keypoints, replaced by the selected subset</param>
+/// <param name="imageSize">Size of the image the keypoints were detected on</param>
+/// <param name="maxKeypoints">Number of keypoints to keep (0 or less keeps all of them)</param>
+/// <param name="scratch">Reused scratch buffers (optional)</param>
+void gridBucketKeypoints(std::vector<cv::KeyPoint>& keypoints, cv::Size imageSize, int maxKeypoints,
+                         int gridCols = 8, int gridRows = 6, KeypointBuckets* scratch = NULL) {
+    if (maxKeypoints <= 0) return;
+    const size_t keepCount = (size_t)maxKeypoints;
+    if (keypoints.size() <= keepCount) return;
+
+    /*Strongest first, so each cell keeps its best corners.*/
+    std::sort(keypoints.begin(), keypoints.end(), [](const cv::KeyPoint& a, const cv::KeyPoint& b) { return a.response > b.response; });
+
+    KeypointBuckets local;
+    KeypointBuckets& buckets = scratch ? *scratch : local;
+    std::vector<int>& cellCounts = buckets.cellCounts;
+    std::vector<cv::KeyPoint>& selected = buckets.selected;
+    std::vector<cv::KeyPoint>& remaining = buckets.remaining;
+    cellCounts.assign(gridCols * gridRows, 0);
+    selected.clear();
+
+    int quota = std::max(1, maxKeypoints / (gridCols * gridRows));
+    while (selected.size() < keepCount && !keypoints.empty()) {
+        remaining.clear();
+        for (const cv::KeyPoint& kp : keypoints) {
+            const int cx = std::min(gridCols - 1, std::max(0, (int)(kp.pt.x * gridCols / imageSize.width)));
+            const int cy = std::min(gridRows - 1, std::max(0, (int)(kp.pt.y * gridRows / imageSize.height)));
+            int& count = cellCounts[cy * gridCols + cx];
+
+            if (count < quota && selected.size() < keepCount) {
+                count++;
+                selected.push_back(kp);
+            }
+            else remaining.push_back(kp);
+        }
+        keypoints.assign(remaining.begin(), remaining.end());
+        quota++;
+    }
+
+    /*Copied rather than swapped, so each buffer keeps its own storage from one call to the next.*/
+    keypoints.assign(selected.begin(), selected.end());
+}
+
+
+
 /// <summary>
 ///     An abstraction over the Feature mappings. It takes 2 images and by using the ORB model provided for 
 ///     free by OpenCV, it generates a set of Feature maps and holds other very useful information. However, for 
@@ -34,35 +130,56 @@ struct ImageFeatureMatch {
     std::vector<cv::DMatch> matches;
     
     // vector of points matched...
-    std::vector <std::pair <cv::Point2f, cv::Point2f> > matchingPoints;
+    Mapper matchingPoints;
+
+    // scratch of the grid bucketing.
+    KeypointBuckets buckets;
 
 
-    /*How things go: Keypoints -> descriptors -> DMatches -> matchingPoints*/
-    ImageFeatureMatch(Mat& baseImage, Mat& targetImage) {
-        /*Computing the keypoints*/
-        cv::Ptr<cv::FeatureDetector> detector = cv::ORB::create();
-        detector->detect(baseImage, this->keypointsBaseImage);
-        detector->detect(targetImage, this->keypointsTargetImage);
-        detector.release();
+    ImageFeatureMatch() {}
+
+    ImageFeatureMatch(Mat& baseImage, Mat& targetImage, int bucketedFeatures = 0,
+                      Rect baseRoi = Rect(), Rect targetRoi = Rect(),
+                      cv::Ptr<cv::ORB> orb = cv::Ptr<cv::ORB>()) {
+        this->match(baseImage, targetImage, bucketedFeatures, baseRoi, targetRoi, orb);
+    }
+
 
-        /*Computing the descriptors*/
-        cv::Ptr<cv::DescriptorExtractor> extractor = cv::ORB::create();
-        extractor->compute(baseImage, this->keypointsBaseImage, this->descriptorsBaseImage);
-        extractor->compute(targetImage, this->keypointsTargetImage, this->descriptorsTargetImage);
-        extractor.release();
+    /*How things go: Keypoints -> (grid bucketing) -> descriptors -> DMatches -> matchingPoints
+      bucketedFeatures > 0 keeps only that many evenly spread keypoints per image (see gridBucketKeypoints). ORB
+      then over-detects (BUCKETING_OVERDETECTION times that many), since its own cap keeps the strongest corners,
+      which are the clustered ones.
+      The regions of interest restrict the work to the predicted overlap (see predictOverlapRegions): ORB runs on
+      the sub-image only, with its budget scaled by the area fraction, and the keypoints are moved back to image
+      coordinates afterwards. An empty Rect means the whole image.
+      A resident ORB object and matcher can be handed in (see StitchServer, FrameContext), otherwise new ones are
+      created.
+      Calling it again on the same object refills the members, reusing their storage (see FrameContext).*/
+    void match(Mat& baseImage, Mat& targetImage, int bucketedFeatures = 0,
+               Rect baseRoi = Rect(), Rect targetRoi = Rect(),
+               cv::Ptr<cv::ORB> orb = cv::Ptr<cv::ORB>(),
+               cv::Ptr<cv::DescriptorMatcher> matcher = cv::Ptr<cv::DescriptorMatcher>()) {
+        if (orb.empty()) orb = cv::ORB::create();
+
+        /*Keypoints (-> grid bucketing) -> descriptors of each image, inside its region of interest*/
+        this->describe(baseImage, baseRoi, bucketedFeatures, orb, this->keypointsBaseImage, this->descriptorsBaseImage);
+        this->describe(targetImage, targetRoi, bucketedFeatures, orb, this->keypointsTargetImage, this->descriptorsTargetImage);
 
         // Create Brute-Force Matcher. Other Algorithms are 'non-free'.
-        cv::BFMatcher brue_force_matcher = cv::BFMatcher(cv::NORM_HAMMING, true);
+        if (matcher.empty()) matcher = cv::BFMatcher::create(cv::NORM_HAMMING, true);
 
         // Find matches and store in matches vector.
-        brue_force_matcher.match((const cv::OutputArray)this->descriptorsBaseImage, (const cv::OutputArray)this->descriptorsTargetImage, this->matches);
+        {
+            ExternalCall opencv;
+            matcher->match(this->descriptorsBaseImage, this->descriptorsTargetImage, this->matches);
+        }
 
         // Sort them in order of their distance. The less distance, the better.
         std::sort(this->matches.begin(), this->matches.end(), [](cv::DMatch& a, cv::DMatch& b) { return a.distance < b.distance; });
         this->matchingPoints.resize(this->matches.size());
 
         /*Filling the pixels matches*/
-        for (int i = 0; i < this->matches.size(); i++) {
+        for (size_t i = 0; i < this->matches.size(); i++) {
             int baseInd = this->matches[i].queryIdx;
             this->matchingPoints[i].first = this->keypointsBaseImage[baseInd].pt;
 
@@ -70,6 +187,40 @@ struct ImageFeatureMatch {
             this->matchingPoints[i].second = this->keypointsTargetImage[targetInd].pt;
         }
     }
+
+private:
+    void describe(Mat& image, Rect roi, int bucketedFeatures, cv::Ptr<cv::ORB>& orb,
+                  std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors) {
+        const Rect whole(0, 0, image.cols, image.rows);
+        roi &= whole;
+        if (roi.area() == 0) roi = whole;
+        const Mat region = image(roi);
+
+        /*ORB's budget shrinks with the region, so the descriptor and matching work scale with the overlap too.*/
+        int budget = bucketedFeatures > 0 ? BUCKETING_OVERDETECTION * bucketedFeatures : ORB_DEFAULT_FEATURES;
+        if (roi.area() < whole.area())
+            budget = std::max(std::max(bucketedFeatures, ROI_MIN_FEATURES), (int)((double)budget * roi.area() / whole.area()));
+        orb->setMaxFeatures(budget);
+
+        /*Sized for the budget up front, so the buffers of the project's side reach their steady size right away.*/
+        this->matchingPoints.reserve(budget);
+        this->buckets.selected.reserve(budget);
+        this->buckets.remaining.reserve(budget);
+
+        {
+            ExternalCall opencv;
+            orb->detect(region, keypoints);
+        }
+        gridBucketKeypoints(keypoints, region.size(), bucketedFeatures, 8, 6, &this->buckets);
+        {
+            ExternalCall opencv;
+            orb->compute(region, keypoints, descriptors);
+        }
+
+        /*Back to the coordinates of the whole image (after compute, which may drop keypoints).*/
+        if (roi.x != 0 || roi.y != 0)
+            for (cv::KeyPoint& kp : keypoints) kp.pt += Point2f((float)roi.x, (float)roi.y);
+    }
 };
 
 
@@ -146,40 +297,45 @@ vector<pair<Mat, Mat>> readTaskImages() {
 ///     http://www.ele.puc-rio.br/~visao/Topicos/Homographies.pdf
 /// </summary>
 /// <param name="pointPairs">Pair of points (Feature map)</param>
+/// <param name="count">Number of pairs (the points may live in scratch memory, see FrameArena)</param>
 /// <param name="imageIdx">Which set of points to take from the given feature map (0 means from a normalization matrix from the feature map domain)</param>
 /// <returns>Normalization matrix</returns>
-Mat getNormalizer(const vector<pair<Point2f, Point2f> >& pointPairs, int imageIdx = 0) {
+Matx33f getNormalizer(const pair<Point2f, Point2f>* pointPairs, size_t count, int imageIdx = 0) {
     /*Getting the mean values*/
     float sumX = 0;
     float sumY = 0;
-    for (unsigned int i = 0; i < pointPairs.size(); i++) {
+    for (unsigned int i = 0; i < count; i++) {
         sumX += (imageIdx == 0)? pointPairs[i].first.x : pointPairs[i].second.x;
         sumY += (imageIdx == 0)? pointPairs[i].first.y : pointPairs[i].second.y;
     }
 
     /*Mean of X and Y*/
-    const float meanX = sumX / (float)pointPairs.size();
-    const float meanY = sumY / (float)pointPairs.size();
+    const float meanX = sumX / (float)count;
+    const float meanY = sumY / (float)count;
 
     /*Forming the scaler in the normalization matrix*/
     float den = 0;
-    for (unsigned int i = 0; i < pointPairs.size(); i++) {
+    for (unsigned int i = 0; i < count; i++) {
         float x = (imageIdx == 0) ? pointPairs[i].first.x : pointPairs[i].second.x;
         float y = (imageIdx == 0) ? pointPairs[i].first.y : pointPairs[i].second.y;
 
         den += sqrt((x - meanX)*(x - meanX) + (y - meanY)*(y - meanY));
     }
 
-    const float scaler = sqrt(2 * pointPairs.size()) / den;
+    const float scaler = sqrt(2 * count) / den;
 
-    Mat T = Mat::eye(3, 3, CV_32F);
-    T.at<float>(2, 2) = 1.0 / scaler;
-    T.at<float>(1, 2) = -meanY;
-    T.at<float>(0, 2) = -meanX;
+    Matx33f T = Matx33f::eye();
+    T(2, 2) = 1.0 / scaler;
+    T(1, 2) = -meanY;
+    T(0, 2) = -meanX;
 
     return scaler * T;
 }
 
+Matx33f getNormalizer(const vector<pair<Point2f, Point2f> >& pointPairs, int imageIdx = 0) {
+    return getNormalizer(pointPairs.data(), pointPairs.size(), imageIdx);
+}
+
 
 /// <summary>
 ///     Trnasform a Point2F by the given transfromation matrix.
@@ -187,22 +343,94 @@ Mat getNormalizer(const vector<pair<Point2f, Point2f> >& pointPairs, int imageId
 /// <param name="p">The desired point to transform</param>
 /// <param name="normalizer">The transformatoin matrix</param>
 /// <returns>Transformed point</returns>
-Point2f transformPoint(const Point2f& p, const Mat& transformer ) {
-    /*Homogenous representation of the point.*/
-    Mat p1(3, 1, CV_32F);
-    p1.at<float>(0, 0) = p.x;
-    p1.at<float>(1, 0) = p.y;
-    p1.at<float>(2, 0) = 1;
-
-    /*Normalizing the point with the normalizer matrix*/
-    Mat p1n = transformer * p1;  // [u, v, 1]
-    p1n = (1.0 / p1n.at<float>(2, 0)) * p1n;
+Point2f transformPoint(const Point2f& p, const Matx33f& transformer) {
+    /*Transforming the homogenous representation of the point [x, y, 1]. Done by hand on the stack, since
+      it runs for every point in every RANSAC iteration.*/
+    const float u = transformer(0, 0) * p.x + transformer(0, 1) * p.y + transformer(0, 2);
+    const float v = transformer(1, 0) * p.x + transformer(1, 1) * p.y + transformer(1, 2);
+    const float w = transformer(2, 0) * p.x + transformer(2, 1) * p.y + transformer(2, 2);
 
     // Note that by default if you apply the normalization matrix. The depth value yould remain 1
-    return Point2f(p1n.at<float>(0, 0), p1n.at<float>(1, 0)); 
+    return Point2f(u / w, v / w);
+}
+
+
+
+
+/// <summary>
+///     Projects the 4 corners of an image plane with the given transformation and gives their bounding box.
+/// </summary>
+/// <param name="size">Size of the image plane to project</param>
+/// <param name="tr">Transformation matrix (CV_32F)</param>
+/// <param name="bounds">Bounding box of the projected corners</param>
+/// <returns>false if a corner falls behind the projection center, the bounds are meaningless then</returns>
+bool projectedBounds(Size size, const Matx33f& tr, Rect& bounds) {
+    const float w = (float)size.width, h = (float)size.height;
+    const Point2f corners[4] = { {0, 0}, {w, 0}, {0, h}, {w, h} };
+
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (const Point2f& c : corners) {
+        if (tr(2, 0) * c.x + tr(2, 1) * c.y + tr(2, 2) <= 0) return false;
+        const Point2f q = transformPoint(c, tr);
+        minX = std::min(minX, q.x);
+        minY = std::min(minY, q.y);
+        maxX = std::max(maxX, q.x);
+        maxY = std::max(maxY, q.y);
+    }
+
+    bounds = Rect((int)std::floor(minX), (int)std::floor(minY),
+                  (int)std::floor(maxX) - (int)std::floor(minX) + 1, (int)std::floor(maxY) - (int)std::floor(minY) + 1);
+    return true;
 }
 
 
+/// <summary>
+///     Predicts where 2 images overlap from an estimate of the homography between them (e.g. a rig prior or the
+///     homography of the previous frame) and returns a region of interest for each image. Each region is the
+///     bounding box of the other image projected into it, grown by margin pixels to tolerate a drifting estimate.
+///     An empty Rect means "the whole image", which is used when the estimate can't be trusted.
+/// </summary>
+/// <param name="baseSize">Size of the base image (first of the matching points)</param>
+/// <param name="targetSize">Size of the target image (second of the matching points)</param>
+/// <param name="baseToTarget">Predicted homography from the base image to the target image</param>
+/// <param name="margin">Pixels added around the predicted overlap</param>
+/// <returns>{base region, target region}</returns>
+pair<Rect, Rect> predictOverlapRegions(Size baseSize, Size targetSize, const Mat& baseToTarget, int margin = 32) {
+    Rect regions[2];
+    const Size sizes[2] = { baseSize, targetSize };
+    const Matx33f H = baseToTarget;
+    const Matx33f transformations[2] = { H.inv(), H }; // projects the *other* image into sizes[i]
+
+    for (int i = 0; i < 2; i++) {
+        Rect overlap;
+        if (!projectedBounds(sizes[1 - i], transformations[i], overlap)) continue;
+
+        overlap = Rect(overlap.x - margin, overlap.y - margin, overlap.width + 2 * margin, overlap.height + 2 * margin);
+        regions[i] = overlap & Rect(0, 0, sizes[i].width, sizes[i].height);
+    }
+
+    return { regions[0], regions[1] };
+}
+
+
+/// <summary>
+///     Checks whether an estimated homography is fit to predict the overlap of the next frame: enough of the
+///     matches must be its inliers, and the overlap it predicts (without margin) must cover a sane fraction of
+///     both images. A bad fit that passed would shrink the next detection onto the wrong region, and the frames
+///     after it would inherit the error.
+/// </summary>
+/// <param name="inliers">Inliers of the estimate (pass matches for estimators without inliers)</param>
+/// <param name="matches">Number of matches the estimate was fitted on</param>
+/// <returns>true if the estimate can be used as the next prediction</returns>
+bool plausibleOverlapEstimate(const Mat& baseToTarget, Size baseSize, Size targetSize, size_t inliers, size_t matches,
+                              double minInlierRatio = 0.25, double minOverlap = 0.05) {
+    if (baseToTarget.empty() || matches == 0 || (double)inliers / matches < minInlierRatio) return false;
+
+    const pair<Rect, Rect> overlap = predictOverlapRegions(baseSize, targetSize, baseToTarget, 0);
+    const double baseFraction = (double)overlap.first.area() / baseSize.area();
+    const double targetFraction = (double)overlap.second.area() / targetSize.area();
+    return baseFraction >= minOverlap && targetFraction >= minOverlap;
+}
 
 
 /// <summary>
@@ -213,26 +441,31 @@ Point2f transformPoint(const Point2f& p, const Mat& transformer ) {
 /// <param name="newImage">Image plane of projection</param>
 /// <param name="tr">Transformation matrix of the orig image</param>
 /// <param name="isPerspective">perspective or orthographic</param>
-void transformImage(Mat origImg, Mat& newImage, Mat tr, bool isPerspective) {
-    Mat invTr = tr.inv();
+/// <param name="offset">Position of newImage's top-left pixel on the full projection plane (used for tiles)</param>
+void transformImage(const Mat& origImg, Mat& newImage, const Matx33f& tr, bool isPerspective, Point offset = Point(0, 0)) {
+    const Matx33f invTr = tr.inv();
     const int WIDTH = origImg.cols;
     const int HEIGHT = origImg.rows;
 
     const int newWIDTH = newImage.cols;
     const int newHEIGHT = newImage.rows;
 
-    for (int x = 0; x < newWIDTH; x++)
-        for (int y = 0; y < newHEIGHT; y++) {
-            Mat pt(3, 1, CV_32F);
-            pt.at<float>(0, 0) = x;
-            pt.at<float>(1, 0) = y;
-            pt.at<float>(2, 0) = 1.0;
-
-            Mat ptTransformed = invTr * pt;
-            if (isPerspective) ptTransformed = (1.0 / ptTransformed.at<float>(2, 0)) * ptTransformed;
-
-            int newX = round(ptTransformed.at<float>(0, 0));
-            int newY = round(ptTransformed.at<float>(1, 0));
+    /*Row by row (the memory order of the image), and the point is transformed on the stack: no allocation per pixel.*/
+    for (int y = 0; y < newHEIGHT; y++)
+        for (int x = 0; x < newWIDTH; x++) {
+            const float px = x + offset.x;
+            const float py = y + offset.y;
+
+            float u = invTr(0, 0) * px + invTr(0, 1) * py + invTr(0, 2);
+            float v = invTr(1, 0) * px + invTr(1, 1) * py + invTr(1, 2);
+            if (isPerspective) {
+                const float w = invTr(2, 0) * px + invTr(2, 1) * py + invTr(2, 2);
+                u /= w;
+                v /= w;
+            }
+
+            int newX = round(u);
+            int newY = round(v);
 
             if ((newX >= 0) && (newX < WIDTH) && (newY >= 0) && (newY < HEIGHT)) newImage.at<Vec3b>(y, x) = origImg.at<Vec3b>(newY, newX);
         }
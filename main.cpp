@@ -7,6 +7,7 @@
 #include <vector>
 #include <exception>
 #include <algorithm>
+#include <memory>
 #include "functions.h"
 #include <thread> 
 
@@ -18,20 +19,41 @@
 #define WINDOW_NAME "image stitcher"
 #define RANSAC_ITERATIONS_COUNT 400
 #define RANSAC_INLIER_THRESHOLD 4 // 3 and 4 are good threshold for inliers 
+#define BUCKETED_FEATURES_COUNT 150	// Keypoints kept per image by GRID_BUCKETING (picked from BUCKETING_OVERDETECTION x as many ORB corners)
+#define RIG_OVERLAP_FRACTION 0.33	// Rig prior: the Dev1/Dev2 frames overlap on about a third of their width
+#define OVERLAP_MARGIN 48				// Pixels added around the predicted overlap by OVERLAP_MASKING
+#define PREDICTION_ITERATIONS_COUNT 100	// RANSAC iterations of an estimate only used to predict the next overlap
+#define TILE_SIZE 512			// Tile edge (pixels) of the out-of-core canvas used by TILED_OUTPUT
+#define SERVER_SOCKET_PATH "/tmp/image_stitcher.sock"	// Unix domain socket of STITCH_SERVER
+#define SEQUENCE_WARMUP_FRAMES 2	// Frames SEQUENCE_RUN may allocate in (growing the buffers) before the COUNT_ALLOCATIONS check
 
 
 /*Uncommenting any of these will change how the project runs.*/
 //#define INFO_LOG										/*For logging into the console the debug and info logs*/
 //#define SHOW_PREPROCESS
+//#define GRID_BUCKETING								/*Keeps a small, evenly spread set of keypoints before matching*/
+//#define OVERLAP_MASKING								/*Detects features only in the overlap predicted by the rig prior / previous frame*/
 //#define NON_NORMALIZED_HOMOGRAPHY
 //#define NORMALIZED_HOMOGRAPHY
 //#define RANSAC_NORMALIZED_HOMOGRAPHY
+//#define TILED_OUTPUT									/*Writes the stitched images into tiled stores instead of a single png*/
+//#define SEQUENCE_RUN									/*Runs RANSAC frame after frame through one FrameContext*/
+//#define COUNT_ALLOCATIONS								/*Test build: SEQUENCE_RUN fails when a steady-state frame allocates*/
+//#define STITCH_SERVER									/*Runs as a long lived server instead of the tasks (POSIX only, see stitch_server.h)*/
+
+#ifdef STITCH_SERVER
+#include "stitch_server.h"
+#endif
+#ifdef COUNT_ALLOCATIONS
+#include "allocation_counter.h"	// replaces the global operator new, test builds only.
+#endif
 
 
 
 void task1(Mapper first10, Mat firstImage, Mat secondImage, int index);
 void task2(Mapper first10, Mat firstImage, Mat secondImage, int index);
 void task3(Mapper featurePoints, Mat firstImage, Mat secondImage, int iterations, double threshold, int index);
+void saveRansacProjection(Homography* hom, Mat firstImage, Mat secondImage, int index);
 
 
 
@@ -60,24 +82,76 @@ void task3(Mapper featurePoints, Mat firstImage, Mat secondImage, int iterations
 /// </summary>
 /// <returns>0</returns>
 int main() {
+	int bucketedFeatures = 0;
+#ifdef GRID_BUCKETING
+	bucketedFeatures = BUCKETED_FEATURES_COUNT;
+#endif
+
+#ifdef STITCH_SERVER
+	/*Serves stitch requests until a client sends SHUTDOWN. Try it with tools/stitch_client.cpp*/
+	StitchServer server(SERVER_SOCKET_PATH, bucketedFeatures, OVERLAP_MARGIN);
+	server.run();
+	return 0;
+#endif
+
 	/*Variables area*/
 	std::vector<std::thread> threadPool;
 	std::vector<ImageFeatureMatch> featuresMaps;
 	std::vector<std::pair<cv::Mat, cv::Mat>> imagePairs = readTaskImages();	// Loading the images from the res file.
-	
-	// Creating a window
-	cv::namedWindow(WINDOW_NAME, cv::WINDOW_AUTOSIZE);
 
 	// A datatype for storing the matches of the 2 images
+
+#ifdef OVERLAP_MASKING
+	/*Rig prior: the base image (Dev2) sits on the right of the target image (Dev1), shifted by the non overlapping width.*/
+	cv::Mat rigPrior = cv::Mat::eye(3, 3, CV_32F);
+	if (!imagePairs.empty())
+		rigPrior.at<float>(0, 2) = (1.0 - RIG_OVERLAP_FRACTION) * imagePairs[0].second.cols;
+	cv::Mat predictedHomography = rigPrior;
+
+	/*The RANSAC estimate of every frame (NULL if it had too few matches or nothing needs it). It predicts the next
+	  frame's overlap, and RANSAC_NORMALIZED_HOMOGRAPHY projects it as it is instead of estimating the frame again.
+	  When it only serves the prediction, a cheaper estimate is enough: the overlap box gets a margin anyway.*/
+	std::vector<std::unique_ptr<RANSACHomography>> frameEstimates;
+#ifdef RANSAC_NORMALIZED_HOMOGRAPHY
+	const bool estimateEveryFrame = true;
+	const unsigned int estimateIterations = RANSAC_ITERATIONS_COUNT;
+#else
+	const bool estimateEveryFrame = false;
+	const unsigned int estimateIterations = PREDICTION_ITERATIONS_COUNT;
+#endif
+#endif
+
 	featuresMaps.reserve(imagePairs.size());
 	for (std::pair<cv::Mat, cv::Mat>& pr : imagePairs) {
-		featuresMaps.push_back(ImageFeatureMatch(pr.first, pr.second));
+#ifdef OVERLAP_MASKING
+		std::pair<cv::Rect, cv::Rect> overlap = predictOverlapRegions(pr.first.size(), pr.second.size(), predictedHomography, OVERLAP_MARGIN);
+		featuresMaps.push_back(ImageFeatureMatch(pr.first, pr.second, bucketedFeatures, overlap.first, overlap.second));
+
+		const Mapper& points = featuresMaps.back().matchingPoints;
+		const bool hasNextFrame = featuresMaps.size() < imagePairs.size();
+		RANSACHomography* estimate = NULL;
+		if (points.size() >= 16 && (hasNextFrame || estimateEveryFrame))
+			estimate = new RANSACHomography(WINDOW_NAME, points, false, estimateIterations, RANSAC_INLIER_THRESHOLD);
+		frameEstimates.emplace_back(estimate);
+
+		/*The next frame of the rig is predicted from this one if the fit looks sane, otherwise from the rig prior again.*/
+		if (estimate && plausibleOverlapEstimate(estimate->getHomography(), pr.first.size(), pr.second.size(),
+		                                         estimate->getInliers().size(), points.size()))
+			predictedHomography = estimate->getHomography();
+		else
+			predictedHomography = rigPrior;
+#else
+		featuresMaps.push_back(ImageFeatureMatch(pr.first, pr.second, bucketedFeatures));
+#endif
 	}
 
 
 //#define SHOW_PREPROCESS
 #ifdef SHOW_PREPROCESS /*Shows the feature mapping between the frist 2 images.*/
 	
+	// Creating a window
+	cv::namedWindow(WINDOW_NAME, cv::WINDOW_AUTOSIZE);
+
 	/*Testing the ImageFeatureMatching for each and ever single image. Press any button to go to the next images.*/
 	for (int i = 0; i < imagePairs.size(); i++) {
 		ImageFeatureMatch temp = featuresMaps[i];
@@ -133,7 +207,13 @@ int main() {
 #ifdef RANSAC_NORMALIZED_HOMOGRAPHY
 	threadPool.clear();
 	for (int i = 0; i < featuresMaps.size(); i++) {
-		threadPool.push_back(std::thread(task3, featuresMaps.at(0).matchingPoints, imagePairs[i].first, imagePairs[i].second, RANSAC_ITERATIONS_COUNT, RANSAC_INLIER_THRESHOLD, i));
+#ifdef OVERLAP_MASKING
+		if (frameEstimates[i]) {
+			threadPool.push_back(std::thread(saveRansacProjection, frameEstimates[i].get(), imagePairs[i].first, imagePairs[i].second, i));
+			continue;
+		}
+#endif
+		threadPool.push_back(std::thread(task3, featuresMaps.at(i).matchingPoints, imagePairs[i].first, imagePairs[i].second, RANSAC_ITERATIONS_COUNT, RANSAC_INLIER_THRESHOLD, i));
 	}
 
 	for (int i = 0; i < threadPool.size(); i++) {
@@ -141,6 +221,52 @@ int main() {
 	}
 #endif // RANSAC_NORMALIZED_HOMOGRAPHY
 
+
+//#define SEQUENCE_RUN
+#ifdef SEQUENCE_RUN
+	/*One context and one estimator for the whole sequence: once the first frames have grown the buffers, the next
+	  frames reuse them (as long as the frames and their feature counts keep the same size). The output names are
+	  built up front. With COUNT_ALLOCATIONS the run is a check: a frame past SEQUENCE_WARMUP_FRAMES whose own code
+	  allocates anything fails it.*/
+	FrameContext frame;
+	std::unique_ptr<RANSACHomography> sequenceHom;
+	std::vector<std::string> outputNames;
+	for (size_t i = 0; i < imagePairs.size(); i++) {
+		outputNames.push_back(homographyOutputName((int)i));
+	}
+#ifdef COUNT_ALLOCATIONS
+	AllocationCounter allocations;
+	bool steadyState = true;
+#endif
+	for (size_t i = 0; i < imagePairs.size(); i++) {
+#ifdef COUNT_ALLOCATIONS
+		allocations.beginFrame();
+#endif
+		frame.features.match(imagePairs[i].first, imagePairs[i].second, bucketedFeatures, cv::Rect(), cv::Rect(), frame.detector(), frame.matcher());
+		if (!sequenceHom)
+			sequenceHom.reset(new RANSACHomography(WINDOW_NAME, frame.features.matchingPoints, frame, false, RANSAC_ITERATIONS_COUNT, RANSAC_INLIER_THRESHOLD));
+		else
+			sequenceHom->calculate();	// the estimator references the context's points, refilled by match()
+		sequenceHom->projectAndSave(imagePairs[i].first, imagePairs[i].second, outputNames[i]);
+#ifdef COUNT_ALLOCATIONS
+		allocations.endFrame();
+		std::cout << "Finished sequence frame: " << i << " (" << allocations.frameHeapAllocations() << " heap, "
+		          << allocations.frameMatAllocations() << " cv::Mat allocations)" << std::endl;
+		if (i >= SEQUENCE_WARMUP_FRAMES && allocations.frameAllocations() > 0) {
+			std::cout << "FAILED: steady-state frame " << i << " allocated" << std::endl;
+			steadyState = false;
+		}
+#else
+		std::cout << "Finished sequence frame: " << i << std::endl;
+#endif
+	}
+#ifdef COUNT_ALLOCATIONS
+	std::cout << "Sequence allocations: " << allocations.totalHeapAllocations() << " heap, "
+	          << allocations.totalMatAllocations() << " cv::Mat" << std::endl;
+	if (!steadyState) return 1;
+#endif
+#endif // SEQUENCE_RUN
+
 	return 0;
 
 }
@@ -152,18 +278,34 @@ int main() {
 
 void task1(Mapper first10, Mat firstImage, Mat secondImage, int index) {
 	NNHomography nonNor(WINDOW_NAME, first10, false);
+#ifdef TILED_OUTPUT
+	nonNor.projectAndSaveTiled(firstImage, secondImage, index, TILE_SIZE, 1);	// the tasks already run a thread per image
+#else
 	nonNor.projectAndSave(firstImage, secondImage, index);
+#endif
 	std::cout << "Finished NON Normalized image: " << index << std::endl;
 }
 
 void task2(Mapper first10, Mat firstImage, Mat secondImage, int index) {
 	NormalizedHomography nonNor(WINDOW_NAME, first10, false);
+#ifdef TILED_OUTPUT
+	nonNor.projectAndSaveTiled(firstImage, secondImage, index, TILE_SIZE, 1);	// the tasks already run a thread per image
+#else
 	nonNor.projectAndSave(firstImage, secondImage, index);
+#endif
 	std::cout << "Finished Normalized image: " << index << std::endl;
 }
 
 void task3(Mapper featurePoints, Mat firstImage, Mat secondImage, int iterations, double threshold, int index) {
 	RANSACHomography hom(WINDOW_NAME, featurePoints, false, iterations, threshold);
-	hom.projectAndSave(firstImage, secondImage, index);
+	saveRansacProjection(&hom, firstImage, secondImage, index);
+}
+
+void saveRansacProjection(Homography* hom, Mat firstImage, Mat secondImage, int index) {
+#ifdef TILED_OUTPUT
+	hom->projectAndSaveTiled(firstImage, secondImage, index, TILE_SIZE, 1);	// the tasks already run a thread per image
+#else
+	hom->projectAndSave(firstImage, secondImage, index);
+#endif
 	std::cout << "Finished Ransac Normalized image: " << index << std::endl;
 }
@@ -0,0 +1,79 @@
+/*Platform specific file mapping of MappedRegion. It is kept in its own translation unit, so <windows.h> (whose
+  ACCESS_MASK clashes with cv::ACCESS_MASK under "using namespace cv") never meets the OpenCV headers.*/
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*Standard Library*/
+#include <stdexcept>
+
+/*Project Utils*/
+#include "mapped_region.h"
+
+
+
+#ifdef _WIN32
+MappedRegion::MappedRegion(const std::string& path, size_t offset, size_t length) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    const size_t alignedOffset = offset - offset % info.dwAllocationGranularity;
+    this->m_mappedLength = length + (offset - alignedOffset);
+
+    this->m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (this->m_file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("can't open tile store at: " + path);
+
+    this->m_mapping = CreateFileMappingA(this->m_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (this->m_mapping == NULL) {
+        CloseHandle(this->m_file);
+        throw std::runtime_error("can't map tile store at: " + path);
+    }
+
+    const unsigned long long off = alignedOffset;
+    this->m_base = (unsigned char*)MapViewOfFile(this->m_mapping, FILE_MAP_WRITE,
+        (DWORD)(off >> 32), (DWORD)(off & 0xFFFFFFFF), this->m_mappedLength);
+    if (this->m_base == NULL) {
+        CloseHandle(this->m_mapping);
+        CloseHandle(this->m_file);
+        throw std::runtime_error("can't map tile store at: " + path);
+    }
+    this->m_data = this->m_base + (offset - alignedOffset);
+}
+
+MappedRegion::~MappedRegion() {
+    UnmapViewOfFile(this->m_base);
+    CloseHandle(this->m_mapping);
+    CloseHandle(this->m_file);
+}
+#else
+MappedRegion::MappedRegion(const std::string& path, size_t offset, size_t length) {
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t alignedOffset = offset - offset % pageSize;
+    this->m_mappedLength = length + (offset - alignedOffset);
+
+    this->m_fd = open(path.c_str(), O_RDWR);
+    if (this->m_fd < 0)
+        throw std::runtime_error("can't open tile store at: " + path);
+
+    void* base = mmap(NULL, this->m_mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, this->m_fd, (off_t)alignedOffset);
+    if (base == MAP_FAILED) {
+        close(this->m_fd);
+        throw std::runtime_error("can't map tile store at: " + path);
+    }
+    this->m_base = (unsigned char*)base;
+    this->m_data = this->m_base + (offset - alignedOffset);
+}
+
+MappedRegion::~MappedRegion() {
+    munmap(this->m_base, this->m_mappedLength);
+    close(this->m_fd);
+}
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+/*The platform specific file mapping lives in mapped_region.cpp, so neither <windows.h> nor the POSIX headers leak
+  into the files including this one.*/
+
+/*Standard Library*/
+#include <string>
+#include <cstddef>
+
+
+
+/// <summary>
+///     A writable view over a byte range of an existing file, mapped into memory. Whatever is written through
+///     data() lands in the file's pages directly, and the OS flushes them when the mapping is released on
+///     destruction. The offset does not have to be aligned, the mapping starts at the closest aligned offset below it.
+/// </summary>
+class MappedRegion {
+public:
+    MappedRegion(const std::string& path, size_t offset, size_t length);
+    ~MappedRegion();
+
+    unsigned char* data() { return this->m_data; }
+private:
+    MappedRegion(const MappedRegion&);              // non-copyable, it owns the mapping.
+    MappedRegion& operator=(const MappedRegion&);
+
+    unsigned char* m_base;  // start of the mapping (aligned).
+    unsigned char* m_data;  // start of the requested range inside the mapping.
+    size_t m_mappedLength;
+    void* m_file;           // HANDLEs on Windows, kept opaque so that this header doesn't need <windows.h>.
+    void* m_mapping;
+    int m_fd;               // file descriptor on POSIX.
+};
@@ -18,14 +18,29 @@ public:
         this->calculate();
     }
 
+    /*Uses the buffers of the frame context instead of its own. mappingPoints must outlive the object.*/
+    RANSACHomography(const std::string& windowName, const Mapper& mappingPoints, FrameContext& context, bool showWindow = false,
+                        unsigned int iterations = 200, double threshold = 1) {
+        this->m_windowName = windowName;
+        this->m_externalPoints = &mappingPoints;
+        this->m_context = &context;
+        this->m_showWindow = showWindow;
+        this->m_threshold = threshold;
+        this->m_iterations = iterations;
+        this->calculate();
+    }
+
     cv::Mat calculate(const Mapper& pointPairs);
-    cv::Mat calculate() { return this->calculate(this->m_mappingPoints); }
+    cv::Mat calculate() { return this->calculate(this->points()); }
+
+    const Mapper& getInliers() { return this->context().bestInliers; } // the inliers points after running the algorithm.
 
 private:
+    cv::Matx33f fitNormalized(const Mapper::value_type* pointPairs, int count);
+    cv::Matx33f fitNormalized(const Mapper& pointPairs) { return this->fitNormalized(pointPairs.data(), (int)pointPairs.size()); }
+
     double m_threshold;
     unsigned int m_iterations;
-    Mapper m_inliers; // the inliers points after running the algorithm.
-
 };
 
 
@@ -37,63 +52,89 @@ private:
 
 
 
+/// <summary>
+///     Same estimation as NormalizedHomography, on the buffers of this object's frame context.
+/// </summary>
+cv::Matx33f RANSACHomography::fitNormalized(const Mapper::value_type* pointPairs, int count) {
+    const cv::Matx33f T = getNormalizer(pointPairs, count);
+    const cv::Matx33f T_ = getNormalizer(pointPairs, count, 1);
+    return T_.inv() * this->solveDLT(pointPairs, count, T, T_) * T;
+}
+
+
+/// <summary>
+///     The samples and the inlier indices of the search are scratch of the frame context's arena; only the final
+///     inliers are copied into the context (getInliers()).
+/// </summary>
 cv::Mat RANSACHomography::calculate(const Mapper& pointPairs) {
-	for (int i = 0; i < this->m_iterations; i++) {
-		/*Generating 4 random indices*/
-		cv::Mat mat(1, 4, CV_32S);
-		int low = 0;
-		int high = pointPairs.size()-1;
-		randu(mat, cv::Scalar(low), cv::Scalar(high));
-
-		/*Check if the indices are unique*/
-		std::vector<int> vec = mat.clone();
-		std::sort(vec.begin(), vec.end());
-		for (int j = 0; j < vec.size() - 1; j++) {
-			if (vec.at(j) == vec.at(j + 1)) {
-				i--;
-				continue;
-			}
-		}
-
-		/*Gathering the point maps*/
-		Mapper chosenSamples(vec.size());
-		for (int j = 0; j < vec.size(); j++) {
-			chosenSamples.at(j) = pointPairs.at(vec.at(j));
-		}
-
-		/*Fitting the model*/
-		NormalizedHomography nh(this->m_windowName, chosenSamples, false);
-		Mat H = nh.getHomography();
-
-		/*Calculating the number of inliers*/
-		vector<pair<Point2f, Point2f>> curInliers;
-		for (int j = 0; j < pointPairs.size(); j++) {
-			Point2f v = pointPairs.at(j).second - transformPoint(pointPairs.at(j).first, H);
-			double dist = sqrt(v.x * v.x + v.y * v.y);
-			if (dist < this->m_threshold) {
-				curInliers.push_back(pointPairs.at(j));
-			}
-		}
-
-		/*Checking if current fit is better*/
-		if (curInliers.size() > this->m_inliers.size()) {
-			this->m_inliers.clear();
-			this->m_inliers = curInliers;
-		}
+    FrameContext& ctx = this->context();
+    FrameArena::Scope scratch(ctx.arena);
+    const int pointsCount = pointPairs.size();
+
+    Mapper::value_type* chosenSamples = ctx.arena.allocate<Mapper::value_type>(4);
+    int* curInliers = ctx.arena.allocate<int>(pointsCount);
+    int* bestInliers = ctx.arena.allocate<int>(pointsCount);
+    int bestCount = 0;
+
+    cv::RNG& rng = cv::theRNG();
+
+    /*Less than 4 points can't be sampled, the model is fitted on all of them below.*/
+    for (unsigned int i = 0; pointsCount >= 4 && i < this->m_iterations; i++) {
+        /*Generating 4 random unique indices*/
+        int indices[4];
+        for (int j = 0; j < 4; j++) {
+            indices[j] = rng.uniform(0, pointsCount);
+            for (int k = 0; k < j; k++) {
+                if (indices[k] == indices[j]) {
+                    j--;
+                    break;
+                }
+            }
+        }
+
+        /*Gathering the point maps*/
+        for (int j = 0; j < 4; j++) {
+            chosenSamples[j] = pointPairs[indices[j]];
+        }
+
+        /*Fitting the model*/
+        const cv::Matx33f H = this->fitNormalized(chosenSamples, 4);
+
+        /*Calculating the number of inliers*/
+        int curCount = 0;
+        for (int j = 0; j < pointsCount; j++) {
+            Point2f v = pointPairs[j].second - transformPoint(pointPairs[j].first, H);
+            double dist = sqrt(v.x * v.x + v.y * v.y);
+            if (dist < this->m_threshold) {
+                curInliers[curCount++] = j;
+            }
+        }
+
+        /*Checking if current fit is better*/
+        if (curCount > bestCount) {
+            std::swap(curInliers, bestInliers);
+            bestCount = curCount;
+        }
 
 #ifdef INFO_LOG
-		cout << "Random points matrix: " << endl;
-		cout << mat << endl;
-		cout << endl;
-		for (int j = 0; j < vec.size(); j++)
-			cout << vec[j] << ", ";
-		cout << endl;
+        cout << "Random indices: ";
+        for (int j = 0; j < 4; j++)
+            cout << indices[j] << ", ";
+        cout << endl;
 #endif
 
-	} // ransac loop
+    } // ransac loop
+
+    /*Gathering the inliers (the context keeps its storage from one frame to the next)*/
+    Mapper& inliers = ctx.bestInliers;
+    inliers.reserve(pointsCount);
+    inliers.clear();
+    for (int j = 0; j < bestCount; j++) {
+        inliers.push_back(pointPairs[bestInliers[j]]);
+    }
 
-	/*Fitting the model*/
-	NormalizedHomography nh(this->m_windowName, this->m_inliers, false);
-	this->m_homography = nh.getHomography();
-	return this->m_homography;
+    /*Fitting the model. With too few inliers (a failed search, or no iterations) it is fitted on all the points,
+      but getInliers() keeps reporting the real inliers, so callers can tell that the fit is not backed by them.*/
+    this->storeHomography(this->fitNormalized(inliers.size() >= 4 ? inliers : pointPairs));
+    return this->m_homography;
 }
@@ -0,0 +1,434 @@
+#pragma once
+#ifdef _WIN32
+#error "StitchServer uses Unix domain sockets and POSIX shared memory, it is not available on Windows."
+#endif
+
+/*POSIX sockets and shared memory*/
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+
+/*Open CV stuff*/
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <opencv2/features2d.hpp>
+
+/*Standard Library*/
+#include <map>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+/*Project Utils*/
+#include "functions.h"
+#include "non_normalized_homography.h"
+#include "normalized_homography.h"
+#include "ransac_homography.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+
+/// <summary>
+///     A long running stitching server. It listens on a Unix domain socket and keeps everything that is expensive
+///     to set up resident between requests: the ORB object and the work buffers (one FrameContext), the decoded images,
+///     their feature matches (per rig, since the rig's prediction decides where they are detected) and the homographies
+///     estimated from them, the last homography of every rig (used to predict the overlap of its next frame) and the
+///     result buffers.
+///
+/// PROTOCOL (one request per line, paths must not contain spaces):
+///     STITCH     <rig> <estimator> <iterations> <threshold> <basePath> <targetPath>
+///     STITCH_SHM <rig> <estimator> <iterations> <threshold> <shmName> <width> <height>
+///     SHUTDOWN
+///
+///     estimator is one of "nn", "normalized" or "ransac" (iterations, at least 1, and threshold are only used by "ransac").
+///     For STITCH_SHM, the POSIX shared memory object shmName holds the base image followed by the target image,
+///     both 8UC3 of width x height (at most STITCH_SERVER_MAX_PIXELS pixels each). These are not cached since their
+///     content changes between requests.
+///
+///     The answer is "OK <shmName> <width> <height> <type> <sequence>" or "ERR <message>". Every rig has its own
+///     output buffer "/image_stitcher_<serverPid>_<rig>", which is overwritten by the rig's next request. It starts
+///     with STITCH_SERVER_BUFFER_HEADER bytes holding the sequence number of the result it contains (a uint64, 0 while
+///     a result is being drawn), followed by the stitched 8UC3 image. A client that copies the image out checks that
+///     the sequence is still the one it was answered afterwards, otherwise its copy was overwritten mid-way.
+///
+///     Clients are served one at a time. A connection that is idle (or doesn't read its answers) for
+///     STITCH_SERVER_CLIENT_TIMEOUT seconds is dropped, so it can't hold the others back.
+/// </summary>
+class StitchServer {
+public:
+    StitchServer(const std::string& socketPath, int bucketedFeatures = 0, int overlapMargin = 32);
+    ~StitchServer();
+
+    void run();
+private:
+    struct SharedBuffer {
+        std::string name;
+        uchar* data;
+        size_t size;
+    };
+
+    struct Estimate {
+        cv::Mat homography;
+        bool predictsOverlap = false;   // sane enough to predict the rig's next overlap (see plausibleOverlapEstimate)
+    };
+
+    StitchServer(const StitchServer&);              // non-copyable, it owns the socket and shared memory.
+    StitchServer& operator=(const StitchServer&);
+
+    std::string handle(const std::string& request);
+    std::string stitch(const std::string& rig, cv::Mat& baseImage, cv::Mat& targetImage, const std::string& cacheKey,
+                       const std::string& estimator, int iterations, double threshold);
+    cv::Mat loadImage(const std::string& path, std::string& cacheKey);
+    SharedBuffer& outputBuffer(const std::string& rig, size_t size);
+
+    std::string m_socketPath;
+    int m_socket;
+    int m_bucketedFeatures, m_overlapMargin;
+    uint64_t m_sequence;                                    // sequence number of the last result
+
+    FrameContext m_frame;                                   // ORB object and work buffers, reused by every request
+    std::map<std::string, cv::Mat> m_images;                // decoded images by "path:mtime"
+    std::map<std::string, Mapper> m_features;               // matching points by "rig|baseKey|targetKey"
+    std::map<std::string, Estimate> m_homographies;         // estimates by "featureKey|estimator|iterations|threshold"
+    std::map<std::string, cv::Mat> m_rigHomographies;       // last homography of every rig
+    std::map<std::string, SharedBuffer> m_outputs;          // result buffer of every rig
+};
+
+
+
+///////////////////////////
+//////////////////////////////////////////// StitchServer Function Definitions ////////////////////////////////////////////
+//////////////////////////
+
+
+
+#define STITCH_SERVER_CACHE_SIZE 64         // images/feature matches/homographies kept before the caches are flushed
+#define STITCH_SERVER_MAX_REQUEST 4096      // bytes a request line may have before the connection is dropped
+#define STITCH_SERVER_MAX_PIXELS (1 << 26)  // pixels of a STITCH_SHM input image (64M, keeps the sizes far from overflowing)
+#define STITCH_SERVER_CLIENT_TIMEOUT 10     // seconds a client may stay silent or not read its answer
+#define STITCH_SERVER_BUFFER_HEADER 8       // bytes before the image in a result buffer (its sequence number)
+
+
+/// <summary>
+///     Sends the whole message, send() may write only a part of it.
+/// </summary>
+bool sendAll(int socket, const std::string& message) {
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t n = send(socket, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+
+StitchServer::StitchServer(const std::string& socketPath, int bucketedFeatures, int overlapMargin) {
+    this->m_socketPath = socketPath;
+    this->m_bucketedFeatures = bucketedFeatures;
+    this->m_overlapMargin = overlapMargin;
+    this->m_sequence = 0;
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("socket path is too long: " + socketPath);
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    this->m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->m_socket < 0)
+        throw std::runtime_error("can't create the server socket");
+
+    unlink(socketPath.c_str());    // left over from a previous run.
+    if (bind(this->m_socket, (sockaddr*)&address, sizeof(address)) < 0 || listen(this->m_socket, 8) < 0) {
+        close(this->m_socket);
+        throw std::runtime_error("can't listen on: " + socketPath);
+    }
+}
+
+
+StitchServer::~StitchServer() {
+    for (auto& output : this->m_outputs) {
+        munmap(output.second.data, output.second.size);
+        shm_unlink(output.second.name.c_str());
+    }
+    close(this->m_socket);
+    unlink(this->m_socketPath.c_str());
+}
+
+
+/// <summary>
+///     Serves the clients one after the other until a SHUTDOWN request arrives. A client may send any number
+///     of requests over its connection. A client that hangs up early must not kill the server, so SIGPIPE is
+///     ignored (MSG_NOSIGNAL is not available everywhere), and one that never ends its line is answered with
+///     an error and dropped once STITCH_SERVER_MAX_REQUEST bytes are pending. Both directions time out after
+///     STITCH_SERVER_CLIENT_TIMEOUT seconds, so a stalled client is dropped rather than blocking the others.
+///     When accept() runs out of resources (e.g. EMFILE) the server backs off for a moment instead of spinning,
+///     any other accept() error stops it.
+/// </summary>
+void StitchServer::run() {
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "Stitch server listening on: " << this->m_socketPath << std::endl;
+
+    bool shutdown = false;
+    while (!shutdown) {
+        int client = accept(this->m_socket, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                usleep(100 * 1000);
+                continue;
+            }
+            std::cout << "Stitch server can't accept clients: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        timeval timeout;
+        timeout.tv_sec = STITCH_SERVER_CLIENT_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int noSigPipe = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+        std::string pending;
+        char chunk[4096];
+        ssize_t n;
+        bool connected = true;
+        while (connected && !shutdown && (n = recv(client, chunk, sizeof(chunk), 0)) > 0) {
+            pending.append(chunk, n);
+
+            size_t eol;
+            while (connected && !shutdown && (eol = pending.find('\n')) != std::string::npos) {
+                std::string request = pending.substr(0, eol);
+                pending.erase(0, eol + 1);
+                if (!request.empty() && request.back() == '\r') request.pop_back();
+
+                if (request == "SHUTDOWN") {
+                    shutdown = true;
+                    sendAll(client, "OK\n");
+                }
+                else connected = sendAll(client, this->handle(request) + "\n");
+            }
+
+            if (connected && pending.size() > STITCH_SERVER_MAX_REQUEST) {
+                sendAll(client, "ERR request longer than " + std::to_string(STITCH_SERVER_MAX_REQUEST) + " bytes\n");
+                connected = false;
+            }
+        }
+        close(client);
+    }
+}
+
+
+std::string StitchServer::handle(const std::string& request) {
+    std::istringstream words(request);
+    std::string command, rig, estimator;
+    int iterations;
+    double threshold;
+    words >> command >> rig >> estimator >> iterations >> threshold;
+    if (!words || iterations < 0 || rig.find('/') != std::string::npos) return "ERR malformed request: " + request;
+
+    try {
+        if (command == "STITCH") {
+            std::string basePath, targetPath, baseKey, targetKey;
+            if (!(words >> basePath >> targetPath)) return "ERR malformed request: " + request;
+
+            cv::Mat baseImage = this->loadImage(basePath, baseKey);
+            cv::Mat targetImage = this->loadImage(targetPath, targetKey);
+            return this->stitch(rig, baseImage, targetImage, rig + "|" + baseKey + "|" + targetKey, estimator, iterations, threshold);
+        }
+
+        if (command == "STITCH_SHM") {
+            std::string shmName;
+            int width, height;
+            if (!(words >> shmName >> width >> height) || width <= 0 || height <= 0) return "ERR malformed request: " + request;
+            if (width > STITCH_SERVER_MAX_PIXELS / height)    // bounded before any size is computed from them.
+                return "ERR images larger than " + std::to_string(STITCH_SERVER_MAX_PIXELS) + " pixels";
+
+            const size_t imageBytes = (size_t)width * height * 3;
+            int fd = shm_open(shmName.c_str(), O_RDONLY, 0);
+            if (fd < 0) return "ERR can't open shared memory: " + shmName;
+
+            /*Reading past the end of the object would raise SIGBUS, so its size must cover both images.*/
+            struct stat info;
+            if (fstat(fd, &info) != 0 || (size_t)info.st_size < 2 * imageBytes) {
+                close(fd);
+                return "ERR shared memory " + shmName + " is smaller than 2 images of " +
+                       std::to_string(width) + "x" + std::to_string(height);
+            }
+            void* input = mmap(NULL, 2 * imageBytes, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (input == MAP_FAILED) return "ERR can't map shared memory: " + shmName;
+
+            /*Headers over the client's buffer, the pixels are not copied.*/
+            cv::Mat baseImage(height, width, CV_8UC3, input);
+            cv::Mat targetImage(height, width, CV_8UC3, (uchar*)input + imageBytes);
+            std::string answer;
+            try {
+                answer = this->stitch(rig, baseImage, targetImage, "", estimator, iterations, threshold);
+            }
+            catch (...) {
+                munmap(input, 2 * imageBytes);
+                throw;
+            }
+            munmap(input, 2 * imageBytes);
+            return answer;
+        }
+    }
+    catch (const std::exception& e) {
+        return std::string("ERR ") + e.what();
+    }
+
+    return "ERR unknown command: " + command;
+}
+
+
+/// <summary>
+///     Decoded images are cached by path and modification time, so an image that is edited on disk is reloaded.
+/// </summary>
+cv::Mat StitchServer::loadImage(const std::string& path, std::string& cacheKey) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) throw std::runtime_error("can't find image at: " + path);
+    cacheKey = path + ":" + std::to_string((long long)info.st_mtime);
+
+    auto cached = this->m_images.find(cacheKey);
+    if (cached != this->m_images.end()) return cached->second;
+
+    cv::Mat image = cv::imread(path);
+    if (image.empty()) throw std::runtime_error("can't read image at: " + path);
+
+    if (this->m_images.size() >= STITCH_SERVER_CACHE_SIZE) this->m_images.clear();
+    return this->m_images[cacheKey] = image;
+}
+
+
+std::string StitchServer::stitch(const std::string& rig, cv::Mat& baseImage, cv::Mat& targetImage, const std::string& cacheKey,
+                                 const std::string& estimator, int iterations, double threshold) {
+    if (baseImage.type() != CV_8UC3 || targetImage.type() != CV_8UC3) return "ERR images must be 8UC3";
+
+    /*Features: from the cache, or detected in the overlap predicted by the rig's last homography.*/
+    const Mapper* features = NULL;
+    auto cached = this->m_features.find(cacheKey);
+    if (!cacheKey.empty() && cached != this->m_features.end()) features = &cached->second;
+    else {
+        std::pair<cv::Rect, cv::Rect> overlap;
+        auto prior = this->m_rigHomographies.find(rig);
+        if (prior != this->m_rigHomographies.end())
+            overlap = predictOverlapRegions(baseImage.size(), targetImage.size(), prior->second, this->m_overlapMargin);
+
+        this->m_frame.features.match(baseImage, targetImage, this->m_bucketedFeatures, overlap.first, overlap.second, this->m_frame.detector(), this->m_frame.matcher());
+        features = &this->m_frame.features.matchingPoints;
+        if (!cacheKey.empty()) {
+            /*Only the points are kept: the descriptors share storage with the frame context, which the next
+              request overwrites in place.*/
+            if (this->m_features.size() >= STITCH_SERVER_CACHE_SIZE) this->m_features.clear();
+            features = &(this->m_features[cacheKey] = this->m_frame.features.matchingPoints);
+        }
+    }
+    const Mapper& matchingPoints = *features;
+
+    /*Homography: from the cache if these features were already estimated with the same parameters.*/
+    const std::string estimateKey = cacheKey.empty() ? "" :
+        cacheKey + "|" + estimator + "|" + std::to_string(iterations) + "|" + std::to_string(threshold);
+    auto known = this->m_homographies.find(estimateKey);
+
+    Estimate estimate;
+    if (!estimateKey.empty() && known != this->m_homographies.end()) estimate = known->second;
+    else {
+        size_t inliers = 0, fitted = 0;
+        if (estimator == "ransac") {
+            if (iterations == 0) return "ERR ransac needs at least 1 iteration";
+            if (matchingPoints.size() < 16) return "ERR not enough matches: " + std::to_string(matchingPoints.size());
+            RANSACHomography hom(rig, matchingPoints, this->m_frame, false, iterations, threshold);
+            estimate.homography = hom.getHomography();
+            inliers = hom.getInliers().size();
+            fitted = matchingPoints.size();
+        }
+        else if (estimator == "nn" || estimator == "normalized") {
+            if (matchingPoints.size() < 11) return "ERR not enough matches: " + std::to_string(matchingPoints.size());
+            Mapper firstFeatures(matchingPoints.begin(), matchingPoints.begin() + 11);
+            inliers = fitted = firstFeatures.size();
+            if (estimator == "nn")
+                estimate.homography = NNHomography(rig, firstFeatures, this->m_frame, false).getHomography();
+            else
+                estimate.homography = NormalizedHomography(rig, firstFeatures, this->m_frame, false).getHomography();
+        }
+        else return "ERR unknown estimator: " + estimator;
+
+        estimate.predictsOverlap = plausibleOverlapEstimate(estimate.homography, baseImage.size(), targetImage.size(), inliers, fitted);
+        if (!estimateKey.empty()) {
+            if (this->m_homographies.size() >= STITCH_SERVER_CACHE_SIZE) this->m_homographies.clear();
+            this->m_homographies[estimateKey] = estimate;
+        }
+    }
+
+    /*Drawing the result straight into the rig's shared buffer. Its sequence reads 0 while it is being drawn.*/
+    const int outputRows = 1.5 * baseImage.rows, outputCols = 2.0 * baseImage.cols;
+    SharedBuffer& buffer = this->outputBuffer(rig, STITCH_SERVER_BUFFER_HEADER + (size_t)outputRows * outputCols * 3);
+    uint64_t* sequence = (uint64_t*)buffer.data;
+    __atomic_store_n(sequence, (uint64_t)0, __ATOMIC_RELEASE);
+    cv::Mat output(outputRows, outputCols, CV_8UC3, buffer.data + STITCH_SERVER_BUFFER_HEADER);
+    Homography::project(baseImage, targetImage, estimate.homography, output);
+    __atomic_store_n(sequence, ++this->m_sequence, __ATOMIC_RELEASE);
+
+    /*Only a sane estimate predicts the rig's next overlap, otherwise its next frame is searched whole again.*/
+    if (estimate.predictsOverlap)
+        this->m_rigHomographies[rig] = estimate.homography;
+    else
+        this->m_rigHomographies.erase(rig);
+
+    return "OK " + buffer.name + " " + std::to_string(outputCols) + " " + std::to_string(outputRows) + " " +
+           type2str(CV_8UC3) + " " + std::to_string(this->m_sequence);
+}
+
+
+/// <summary>
+///     Returns the rig's result buffer, (re)creating it only when the requested size changes. The name carries the
+///     server's pid, so servers running side by side don't share buffers. It is created exclusively: an object
+///     that already has this name can only be left over by a crashed process with the same pid, and is replaced.
+/// </summary>
+StitchServer::SharedBuffer& StitchServer::outputBuffer(const std::string& rig, size_t size) {
+    auto existing = this->m_outputs.find(rig);
+    if (existing != this->m_outputs.end()) {
+        if (existing->second.size == size) return existing->second;
+        munmap(existing->second.data, existing->second.size);
+        shm_unlink(existing->second.name.c_str());
+        this->m_outputs.erase(existing);
+    }
+
+    SharedBuffer buffer;
+    buffer.name = "/image_stitcher_" + std::to_string((long long)getpid()) + "_" + rig;
+    buffer.size = size;
+
+    int fd = shm_open(buffer.name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        shm_unlink(buffer.name.c_str());
+        fd = shm_open(buffer.name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd < 0) throw std::runtime_error("can't create shared memory: " + buffer.name);
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        throw std::runtime_error("can't resize shared memory: " + buffer.name);
+    }
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("can't map shared memory: " + buffer.name);
+
+    buffer.data = (uchar*)data;
+    return this->m_outputs[rig] = buffer;
+}
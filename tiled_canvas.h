@@ -0,0 +1,164 @@
+#pragma once
+/*Open CV stuff*/
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+/*Standard Library*/
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <stdexcept>
+#include <iostream>
+
+/*Project Utils*/
+#include "functions.h"
+#include "mapped_region.h"
+
+
+
+/// <summary>
+///     An out-of-core canvas for stitching outputs that do not fit into memory. The canvas is split into square
+///     tiles of tileSize x tileSize pixels which are stored one after the other (row-major tile order, edge tiles
+///     padded) in a raw tile store on disk. A small text header "<path>.hdr" describes the layout.
+///
+///     Each tile is rendered into a memory-mapped window of the store, and only the sources whose projected
+///     footprint overlaps the tile are warped into it. Therefore, the peak memory depends on the tile size and the
+///     number of threads, not on the size of the panorama. Sources are painted in the order they were added,
+///     so later sources overwrite the earlier ones (same as Homography::projectAndSave).
+/// </summary>
+class TiledCanvas {
+public:
+    TiledCanvas(const std::string& path, int width, int height, int type, int tileSize = 512);
+
+    void addSource(const cv::Mat& image, const cv::Mat& transformation);
+    void render(unsigned int threadsCount = std::thread::hardware_concurrency());
+
+    int tilesAcross() const { return (this->m_width + this->m_tileSize - 1) / this->m_tileSize; }
+    int tilesDown() const { return (this->m_height + this->m_tileSize - 1) / this->m_tileSize; }
+    cv::Rect tileRect(int tileIndex) const;
+private:
+    struct Source {
+        cv::Mat image;
+        cv::Mat transformation;
+        cv::Rect footprint;     // bounding box of the projected image on the canvas.
+    };
+
+    cv::Rect footprintOf(const cv::Mat& image, const cv::Mat& transformation) const;
+    void renderTile(int tileIndex);
+
+    std::string m_path;
+    int m_width, m_height, m_type, m_tileSize;
+    size_t m_tileBytes;
+    std::vector<Source> m_sources;
+};
+
+
+
+///////////////////////////
+//////////////////////////////////////////// TiledCanvas Function Definitions ////////////////////////////////////////////
+//////////////////////////
+
+
+
+TiledCanvas::TiledCanvas(const std::string& path, int width, int height, int type, int tileSize) {
+    this->m_path = path;
+    this->m_width = width;
+    this->m_height = height;
+    this->m_type = type;
+    this->m_tileSize = tileSize;
+    this->m_tileBytes = (size_t)tileSize * tileSize * CV_ELEM_SIZE(type);
+
+    /*Reserving the whole store on disk. The file is sparse/zero filled, so untouched pixels stay black.*/
+    const size_t totalBytes = this->m_tileBytes * this->tilesAcross() * this->tilesDown();
+    std::ofstream store(path, std::ios::binary | std::ios::trunc);
+    store.seekp(totalBytes - 1);
+    store.put(0);
+    if (!store)
+        throw std::runtime_error("can't create tile store at: " + path);
+
+    /*Header describing the layout, so the store can be read back (or converted to a tiled TIFF) later.*/
+    std::ofstream header(path + ".hdr");
+    header << "width " << width << "\n"
+           << "height " << height << "\n"
+           << "type " << type2str(type) << "\n"
+           << "tile_size " << tileSize << "\n"
+           << "tiles_across " << this->tilesAcross() << "\n"
+           << "tiles_down " << this->tilesDown() << "\n";
+    header.flush();
+    if (!header)
+        throw std::runtime_error("can't write tile store header at: " + path + ".hdr");
+}
+
+
+cv::Rect TiledCanvas::tileRect(int tileIndex) const {
+    const int x = (tileIndex % this->tilesAcross()) * this->m_tileSize;
+    const int y = (tileIndex / this->tilesAcross()) * this->m_tileSize;
+    return cv::Rect(x, y, this->m_tileSize, this->m_tileSize);
+}
+
+
+/// <summary>
+///     Bounding box of the projected image (with 1 pixel of slack for the rounding in transformImage). If the
+///     projection is unreliable (see projectedBounds), the whole canvas is returned instead.
+/// </summary>
+cv::Rect TiledCanvas::footprintOf(const cv::Mat& image, const cv::Mat& transformation) const {
+    cv::Rect box;
+    if (!projectedBounds(image.size(), transformation, box)) return cv::Rect(0, 0, this->m_width, this->m_height);
+    return cv::Rect(box.x - 1, box.y - 1, box.width + 2, box.height + 2);
+}
+
+
+void TiledCanvas::addSource(const cv::Mat& image, const cv::Mat& transformation) {
+    this->m_sources.push_back({ image, transformation, this->footprintOf(image, transformation) });
+}
+
+
+void TiledCanvas::renderTile(int tileIndex) {
+    const cv::Rect rect = this->tileRect(tileIndex);
+
+    MappedRegion region(this->m_path, tileIndex * this->m_tileBytes, this->m_tileBytes);
+    cv::Mat tile(this->m_tileSize, this->m_tileSize, this->m_type, region.data());
+
+    for (const Source& src : this->m_sources) {
+        if ((src.footprint & rect).area() == 0) continue;
+        transformImage(src.image, tile, src.transformation, true, rect.tl());
+    }
+}
+
+
+/// <summary>
+///     Renders all the tiles. The workers pull tile indices from a shared counter, so every thread holds at most
+///     one mapped tile at a time. If a tile fails (e.g. it can't be mapped), the other workers stop at their next
+///     tile and the first error is rethrown once they are joined, so a half rendered store is never reported as done.
+/// </summary>
+void TiledCanvas::render(unsigned int threadsCount) {
+    const int tilesCount = this->tilesAcross() * this->tilesDown();
+    std::atomic<int> nextTile(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorLock;
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < std::max(1u, threadsCount); i++) {
+        workers.push_back(std::thread([this, &nextTile, &failed, &error, &errorLock, tilesCount]() {
+            try {
+                for (int t = nextTile++; t < tilesCount && !failed; t = nextTile++)
+                    this->renderTile(t);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,191 @@
+/// <summary>
+///     A small command line client for the stitching server (see stitch_server.h and STITCH_SERVER in main.cpp).
+///     It sends one request, prints the answer, and for a successful stitch maps the result from shared memory and
+///     saves it as a binary PPM (unless the rig's next result overwrote it meanwhile). It doesn't depend on OpenCV:
+///         g++ -std=c++14 tools/stitch_client.cpp -o stitch_client -lrt
+///
+///     With STITCH_SHM, the 2 inputs are binary PPMs of the same size. The client copies them (as BGR) into a shared
+///     memory object of its own, sends its name and the image size in place of the paths, and removes it afterwards.
+///
+/// USAGE:
+///     stitch_client <socketPath> <outputPpm> STITCH <rig> <estimator> <iterations> <threshold> <basePath> <targetPath>
+///     stitch_client <socketPath> <outputPpm> STITCH_SHM <rig> <estimator> <iterations> <threshold> <basePpm> <targetPpm>
+///     stitch_client <socketPath> - SHUTDOWN
+/// </summary>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+
+#define RESULT_HEADER_BYTES 8   // sequence number in front of a result image (STITCH_SERVER_BUFFER_HEADER)
+
+
+/// <summary>
+///     Reads a binary PPM (P6, 8 bits) and returns its pixels as BGR, the layout the server expects.
+/// </summary>
+bool readPpm(const std::string& path, int& width, int& height, std::vector<unsigned char>& bgr) {
+    std::ifstream ppm(path, std::ios::binary);
+    std::string magic;
+    int maxValue = 0;
+    ppm >> magic;
+    for (int* field : { &width, &height, &maxValue }) {
+        while (ppm >> std::ws && ppm.peek() == '#') ppm.ignore(1 << 20, '\n');    // comment lines
+        ppm >> *field;
+    }
+    ppm.get();    // the single whitespace before the pixels
+    if (!ppm || magic != "P6" || maxValue != 255 || width <= 0 || height <= 0) return false;
+
+    bgr.resize((size_t)width * height * 3);
+    ppm.read((char*)bgr.data(), bgr.size());
+    if (!ppm) return false;
+    for (size_t i = 0; i < bgr.size(); i += 3) std::swap(bgr[i], bgr[i + 2]);
+    return true;
+}
+
+
+/// <summary>
+///     Puts the base and the target image one after the other into a new shared memory object (STITCH_SHM input).
+/// </summary>
+bool writeInputBuffer(const std::string& shmName, const std::string& basePpm, const std::string& targetPpm, int& width, int& height) {
+    int targetWidth, targetHeight;
+    std::vector<unsigned char> base, target;
+    if (!readPpm(basePpm, width, height, base) || !readPpm(targetPpm, targetWidth, targetHeight, target)) {
+        std::cout << "can't read the input PPMs: " << basePpm << ", " << targetPpm << std::endl;
+        return false;
+    }
+    if (width != targetWidth || height != targetHeight) {
+        std::cout << "the input images must have the same size" << std::endl;
+        return false;
+    }
+
+    int shm = shm_open(shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (shm < 0) {
+        std::cout << "can't create shared memory: " << shmName << std::endl;
+        return false;
+    }
+    const size_t size = base.size() + target.size();
+    void* data = ftruncate(shm, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0) : MAP_FAILED;
+    close(shm);
+    if (data == MAP_FAILED) {
+        std::cout << "can't map shared memory: " << shmName << std::endl;
+        shm_unlink(shmName.c_str());
+        return false;
+    }
+
+    memcpy(data, base.data(), base.size());
+    memcpy((unsigned char*)data + base.size(), target.data(), target.size());
+    munmap(data, size);
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::cout << "usage: " << argv[0] << " <socketPath> <outputPpm|-> <request words...>" << std::endl;
+        return 1;
+    }
+
+    std::string request = argv[3];
+    std::string inputName;
+    if (request == "STITCH_SHM") {
+        if (argc != 10) {
+            std::cout << "usage: " << argv[0] << " <socketPath> <outputPpm|-> STITCH_SHM <rig> <estimator> <iterations> <threshold> <basePpm> <targetPpm>" << std::endl;
+            return 1;
+        }
+
+        /*The 2 paths are replaced by the input buffer: "<shmName> <width> <height>"*/
+        int width, height;
+        inputName = "/image_stitcher_input_" + std::to_string(getpid());
+        if (!writeInputBuffer(inputName, argv[8], argv[9], width, height)) return 1;
+        for (int i = 4; i < 8; i++) request += std::string(" ") + argv[i];
+        request += " " + inputName + " " + std::to_string(width) + " " + std::to_string(height);
+    }
+    else
+        for (int i = 4; i < argc; i++) request += std::string(" ") + argv[i];
+    request += "\n";
+
+    /*Connecting to the server and sending the request*/
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        std::cout << "can't connect to: " << argv[1] << std::endl;
+        if (!inputName.empty()) shm_unlink(inputName.c_str());
+        return 1;
+    }
+    if (send(fd, request.data(), request.size(), 0) != (ssize_t)request.size()) {
+        std::cout << "can't send the request" << std::endl;
+        close(fd);
+        if (!inputName.empty()) shm_unlink(inputName.c_str());
+        return 1;
+    }
+
+    /*Reading the one line answer, the server is done with the input buffer then*/
+    std::string answer;
+    char c;
+    while (recv(fd, &c, 1, 0) == 1 && c != '\n') answer += c;
+    close(fd);
+    if (!inputName.empty()) shm_unlink(inputName.c_str());
+    std::cout << answer << std::endl;
+
+    std::istringstream words(answer);
+    std::string status, shmName, type;
+    int width, height;
+    uint64_t sequence;
+    words >> status >> shmName >> width >> height >> type >> sequence;
+    if (status != "OK" || !words || std::string(argv[2]) == "-") return status == "OK" ? 0 : 1;
+
+    /*Mapping the result (after the sequence header) and copying it out (BGR -> RGB for PPM)*/
+    const size_t imageBytes = (size_t)width * height * 3;
+    const size_t size = RESULT_HEADER_BYTES + imageBytes;
+    int shm = shm_open(shmName.c_str(), O_RDONLY, 0);
+    if (shm < 0) {
+        std::cout << "can't open shared memory: " << shmName << std::endl;
+        return 1;
+    }
+    struct stat info;
+    void* data = (fstat(shm, &info) == 0 && (size_t)info.st_size >= size) ?
+        mmap(NULL, size, PROT_READ, MAP_SHARED, shm, 0) : MAP_FAILED;
+    close(shm);
+    if (data == MAP_FAILED) {
+        std::cout << "can't map shared memory: " << shmName << std::endl;
+        return 1;
+    }
+
+    const uint64_t* header = (const uint64_t*)data;
+    const unsigned char* pixels = (const unsigned char*)data + RESULT_HEADER_BYTES;
+    std::vector<unsigned char> rgb(imageBytes);
+    const bool current = __atomic_load_n(header, __ATOMIC_ACQUIRE) == sequence;
+    for (size_t i = 0; i < imageBytes; i += 3) {
+        rgb[i] = pixels[i + 2];
+        rgb[i + 1] = pixels[i + 1];
+        rgb[i + 2] = pixels[i];
+    }
+    const bool unchanged = current && __atomic_load_n(header, __ATOMIC_ACQUIRE) == sequence;
+    munmap(data, size);
+    if (!unchanged) {
+        std::cout << "the result " << sequence << " was overwritten by a newer request of the rig" << std::endl;
+        return 1;
+    }
+
+    std::ofstream ppm(argv[2], std::ios::binary);
+    ppm << "P6\n" << width << " " << height << "\n255\n";
+    ppm.write((const char*)rgb.data(), rgb.size());
+
+    std::cout << "saved: " << argv[2] << std::endl;
+    return 0;
+}